@@ -6,9 +6,15 @@
 
 #include <eosiolib/asset.hpp>
 #include <eosiolib/eosio.hpp>
+#include <eosiolib/singleton.hpp>
 #include <eosiolib/time.hpp>
 
+#include <iscoinalpha1/storage.hpp>
+#include <iscoinalpha1/table_cursor.hpp>
+
 #include <string>
+#include <type_traits>
+#include <vector>
 
 // time in seconds
 const uint32_t ONE_MINUTE = 60;
@@ -46,6 +52,14 @@ namespace eosio {
          [[eosio::action]]
          void close( name owner, const symbol& symbol );
 
+         // batch open and close, for provisioning many accounts at once
+
+         [[eosio::action]]
+         void openmany( std::vector<name> owners, const symbol& symbol, name ram_payer );
+
+         [[eosio::action]]
+         void closemany( std::vector<name> owners, const symbol& symbol );
+
          [[eosio::action]]
          void addstake( name     staker,
                         asset    quantity,
@@ -54,6 +68,72 @@ namespace eosio {
          [[eosio::action]]
          void update( const symbol& symbol );
 
+         // moves stake stats from the old stakestats layout to stakertiers,
+         // rebuilding each from the staker's stakes. handles up to max_rows
+         // stakers per call; repeat until stakestats is empty.
+         [[eosio::action]]
+         void migrstakes( const symbol& symbol, uint32_t max_rows );
+
+         // creates the global row of a token created before it existed, from
+         // the boost counter in its old stat row and the stake stats. run
+         // once, after migrstakes has emptied stakestats. updates fail until
+         // then, so it also schedules the next update.
+         [[eosio::action]]
+         void migrglobal( const symbol& symbol );
+
+         // account summaries
+
+         struct stake_summary {
+            uint64_t                id;
+            asset                   quantity;
+            size_t                  duration_index;
+            eosio::time_point_sec   expires;
+         };
+
+         struct account_summary {
+            name                         owner;
+            asset                        balance;
+            asset                        staked;   // active stakes only
+            asset                        unstaked; // spendable now
+            int64_t                      stake_weight;
+            std::vector<stake_summary>   stakes;   // active stakes
+         };
+
+         // reports balance and stakes of each owner through acctresult.
+         // needs no authority and writes nothing.
+         [[eosio::action]]
+         void acctsummary( std::vector<name> owners, const symbol& symbol );
+
+         // result notifications.
+         // sent inline to this contract so that their data shows up in the
+         // action trace, standing in for action return values.
+
+         [[eosio::action]]
+         void xferresult( name         from,
+                          name         to,
+                          const asset& quantity,
+                          const asset& fee,
+                          const asset& to_stakers,
+                          const asset& to_self,
+                          uint32_t     expired_stakes );
+
+         [[eosio::action]]
+         void stakeresult( name            staker,
+                           uint64_t        stake_id,
+                           const asset&    total_stake,
+                           uint32_t        expired_stakes );
+
+         [[eosio::action]]
+         void updateresult( uint32_t       expired_stakes,
+                            uint16_t       boost,
+                            const asset&   boost_amount,
+                            const asset&   to_stakers,
+                            const asset&   to_self,
+                            const asset&   fees_merged );
+
+         [[eosio::action]]
+         void acctresult( const std::vector<account_summary>& summaries );
+
          static asset get_supply( name token_contract_account, symbol_code sym_code )
          {
             stats statstable( token_contract_account, sym_code.raw() );
@@ -80,11 +160,39 @@ namespace eosio {
             asset                   max_supply;
             eosio::time_point_sec   created;
             eosio::time_point_sec   updated;
-            uint16_t                boosts; // number of boosts so far
 
             uint64_t primary_key()const { return supply.symbol.code().raw(); }
          };
 
+         // stat layout before the global row. only read by migrglobal.
+         struct legacy_currency_stats {
+            asset                   supply;
+            asset                   max_supply;
+            eosio::time_point_sec   created;
+            eosio::time_point_sec   updated;
+            uint16_t                boosts;
+
+            uint64_t primary_key()const { return supply.symbol.code().raw(); }
+         };
+
+         // the leading fields of global_state, which are all that transfers
+         // need. they read and write just these.
+         struct transfer_state {
+            symbol                  token_symbol;
+            std::vector<int64_t>    tier_stakes; // total staked at each duration index
+         };
+
+         // state of a symbol that the hot paths need, read once per action.
+         // a nested struct serializes as its fields in place, so transfer
+         // serializes as the leading fields of the row.
+         struct [[eosio::table]] global_state {
+            transfer_state          transfer;
+
+            eosio::time_point_sec   created;
+            uint16_t                boosts; // number of boosts so far
+            eosio::time_point_sec   next_boost;
+         };
+
          struct [[eosio::table]] stake {
             uint64_t                id; // use available_primary_key() to generate
             asset                   quantity;
@@ -95,6 +203,15 @@ namespace eosio {
          };
 
          struct [[eosio::table]] stake_stat {
+            name                    staker;
+            asset                   total_stake;
+            std::vector<int64_t>    tier_stakes; // amount staked at each duration index
+
+            uint64_t primary_key()const { return staker.value; }
+         };
+
+         // stake stat layout before per-tier amounts. only read by migrstakes.
+         struct [[eosio::table]] legacy_stake_stat {
             name           staker;
             asset          total_stake;
             int64_t        stake_weight;
@@ -102,21 +219,101 @@ namespace eosio {
             uint64_t primary_key()const { return staker.value; }
          };
 
+         // fees owed to this account, spread over a few rows so that
+         // transfers don't all write this account's balance row
+         struct [[eosio::table]] fee_sink {
+            uint64_t       shard;
+            asset          balance;
+
+            uint64_t primary_key()const { return shard; }
+         };
+
+         // stake stats of many stakers packed into one row, sorted by staker.
+         // a page holds the stakers from its key up to the next page's key.
+         struct [[eosio::table]] stake_stat_page {
+            uint64_t                  first; // lowest staker the page can hold
+            std::vector<stake_stat>   entries;
+
+            uint64_t primary_key()const { return first; }
+         };
+
          typedef eosio::multi_index< "accounts"_n, account > accounts;
          typedef eosio::multi_index< "stat"_n, currency_stats > stats;
          typedef eosio::multi_index< "stakes"_n, stake> stakes;
-         typedef eosio::multi_index< "stakestats"_n, stake_stat> stake_stats;
+         typedef eosio::multi_index< "stakertiers"_n, stake_stat> stake_stats;
+         typedef eosio::multi_index< "stakestats"_n, legacy_stake_stat> legacy_stake_stats;
+         typedef eosio::multi_index< "stakepages"_n, stake_stat_page> stake_stat_pages;
+         typedef eosio::singleton< "global"_n, global_state> global_state_singleton;
+         typedef eosio::multi_index< "feesinks"_n, fee_sink> fee_sinks;
+
+         // cursors for bulk scans, which shouldn't go through the multi_index cache
+         typedef eosio::table_cursor< "stakestats"_n, legacy_stake_stat> legacy_stake_stat_cursor;
+         typedef eosio::table_cursor< "stat"_n, legacy_currency_stats> legacy_stats_cursor;
+
+         // balances and stakes go through the storage interface too, so the
+         // per-staker stake scans run through a cursor and only write what
+         // they remove. both stay one row per key.
+         typedef eosio::row_store< "accounts"_n, account> account_store;
+         typedef eosio::row_store< "stakes"_n, stake> stake_store;
+
+         // stake stats storage.
+         // if paging is on, stake stats are kept in stakepages instead of
+         // one stakertiers row per staker, so full passes read far fewer rows.
+         // choose the mode before anything is staked; there is no migration.
+         // an entry is about 73 bytes, and a store rewrites its whole page,
+         // so pages are kept to about 2.3 KB. that is still 1/32 as many
+         // rows for a full pass.
+         static const bool stake_stat_paging = false;
+         static const size_t stake_stat_page_capacity = 32;
+
+         typedef eosio::row_store< "stakertiers"_n, stake_stat> stake_stat_row_store;
+         typedef eosio::paged_store< "stakepages"_n, stake_stat_page, stake_stat_page_capacity> stake_stat_paged_store;
+         typedef std::conditional< stake_stat_paging, stake_stat_paged_store, stake_stat_row_store >::type stake_stat_store;
+
+         // outcomes of the internal operations, reported by the result actions
+
+         struct fee_result {
+            asset    fee;
+            asset    to_stakers;
+            asset    to_self;
+            uint32_t expired_stakes; // the sender's own, released first
+         };
+
+         struct stake_result {
+            uint64_t stake_id;
+            asset    total_stake;
+            uint32_t expired_stakes; // the staker's own, released first
+         };
+
+         struct boost_result {
+            uint16_t boost; // 0 if no boost was released
+            asset    amount;
+            asset    to_stakers;
+            asset    to_self;
+         };
 
          void issue( asset quantity );
-         void sub_balance( name owner, asset value );
+         // reads through the action's one singleton instance, so that its
+         // set() reuses the cached row instead of reading it again
+         global_state get_global_state( global_state_singleton& global );
+
+         fee_result sub_balance( name owner, asset value, std::vector<int64_t>& tier_stakes );
          void add_balance( name owner, asset value, name ram_payer );
 
-         void add_stake( name     staker,
-                        asset    quantity,
-                        size_t   duration_index );
+         void check_symbol( const symbol& symbol );
+         void open_balance( name owner, const symbol& symbol, name ram_payer );
+         void close_balance( name owner, const symbol& symbol );
+
+         stake_result add_stake( name     staker,
+                                 asset    quantity,
+                                 size_t   duration_index );
+         void send_stake_result( name staker, const stake_result& result );
 
-         void update_stakes( const symbol& symbol );
-         void update_boost( const symbol& symbol );
+         uint32_t expire_stakes( name staker, const symbol& symbol, stake_stat& stat, std::vector<int64_t>& tier_stakes );
+         uint32_t rescan_stakes( stake_stat& st, const symbol& symbol, std::vector<int64_t>& tier_stakes );
+         uint32_t update_stakes( const symbol& symbol, std::vector<int64_t>& tier_stakes );
+         boost_result update_boost( const symbol& symbol, global_state& state );
+         void schedule_update( const symbol& symbol );
          const uint32_t update_interval = ONE_MINUTE;
 
          // distribution
@@ -149,18 +346,47 @@ namespace eosio {
             100,
          };
 
-         asset get_stake( name owner, const symbol& symbol )const;
-         int64_t get_stake_weight( name owner, const symbol& symbol )const;
-         asset get_unstaked_balance( name owner, const symbol& symbol )const;
+         // serialized transfer_state: symbol, then the length and amounts of
+         // tier_stakes. a length below 128 takes one byte.
+         static_assert( stake_count < 128, "tier_stakes length must fit in one byte" );
+         static const size_t transfer_state_max_size =
+            sizeof(decltype(transfer_state::token_symbol)) + 1 +
+            stake_count * sizeof(decltype(transfer_state::tier_stakes)::value_type);
+         typedef eosio::singleton_prefix< "global"_n, transfer_state, transfer_state_max_size> transfer_state_prefix;
+         bool find_stake_stat( name staker, const symbol& symbol, stake_stat& stat )const;
+         // a stake stat with no stake is removed
+         void store_stake_stat( const stake_stat& stat );
+
+         // weights are applied to the per-tier amounts when needed, so
+         // changing stake_weights doesn't need a rescan
+         int64_t tier_stake_weight( const std::vector<int64_t>& tier_stakes )const;
+
+         eosio::time_point_sec stake_expiry( const stake& stk )const
+         {
+            return stk.start + stake_durations[stk.duration_index];
+         }
+
+         // data size of one acctresult, leaving headroom under the default
+         // max_inline_action_size of 4 KB
+         static const size_t account_result_max_size = 3 * 1024;
+
+         account_summary get_account_summary( name owner, const symbol& symbol )const;
 
          // transaction fee
 
          const float transaction_fee = 0.01; // 1%
          const float transaction_fee_to_stakers = 0.7f; // 70% of the transaction fee
          // const float transaction_fee_to_likes = 0.15f; // 15%
-         // this account gets the rest
+         // this account gets the rest, through the fee sinks
+
+         // fee sinks. a transfer's share goes to the shard picked by
+         // hashing the sender, and update merges them into this account.
+         static const uint32_t fee_sink_shard_bits = 3; // 8 shards
+
+         void add_to_fee_sink( name sender, asset value );
+         asset merge_fee_sinks( const symbol& symbol );
 
-         int64_t distribute( asset quantity );
+         int64_t distribute( asset quantity, int64_t total_weight );
 
          // boost
          // TODO: change to weekly
@@ -0,0 +1,528 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include <eosiolib/datastream.hpp>
+#include <eosiolib/db.h>
+#include <eosiolib/eosio.hpp>
+
+#include <iscoinalpha1/table_cursor.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace eosio {
+
+   // storage backends for tables that are both looked up by key and scanned
+   // in bulk. they share one interface, so the contract picks a layout with
+   // a typedef and its logic doesn't change:
+   //
+   //    bool find( uint64_t key, T& row )const;
+   //    void store( const T& row, name payer );  // inserts or replaces
+   //    bool insert( const T& row, name payer ); // false if the key is taken
+   //    bool update( uint64_t key, name payer, F&& f );
+   //    void upsert( const T& initial, name payer, F&& f );
+   //    void erase( uint64_t key );
+   //    uint64_t available_primary_key()const;   // one past the highest key
+   //    void for_each( F&& f )const;              // f( const T& ), in key order
+   //    void update_each( F&& f, name payer );    // f( T& ), erasing rows it returns false for
+   //    void erase_if( F&& f );                   // f( const T& ), erasing rows it returns true for
+   //
+   // update() runs f( T& ) on the row with the key, and erases the row if f
+   // returns false. it returns false if there is no such row. upsert() runs
+   // f( T& ) on the row with initial's key, or on initial if there is none,
+   // and stores the result. new rows are paid for by payer; existing ones
+   // keep theirs. each of these looks the key up once, so prefer them to a
+   // find() followed by store() or erase().
+   //
+   // scans go through table_cursor, so they run in constant memory.
+   // erase_if only writes where it erases, so a scan that usually finds
+   // nothing to remove costs reads only.
+
+   // one row per key
+   template<name::raw TableName, typename T>
+   class row_store {
+      public:
+         row_store( name code, uint64_t scope )
+         :_code(code), _scope(scope) {}
+
+         bool find( uint64_t key, T& row )const
+         {
+            table rows( _code, _scope );
+            const auto it = rows.find( key );
+            if( it == rows.end() ) {
+               return false;
+            }
+            row = *it;
+            return true;
+         }
+
+         void store( const T& row, name payer )
+         {
+            table rows( _code, _scope );
+            const auto it = rows.find( row.primary_key() );
+            if( it == rows.end() ) {
+               rows.emplace( payer, [&]( auto& r ) {
+                  r = row;
+               });
+            } else {
+               rows.modify( it, payer, [&]( auto& r ) {
+                  r = row;
+               });
+            }
+         }
+
+         bool insert( const T& row, name payer )
+         {
+            table rows( _code, _scope );
+            if( rows.find( row.primary_key() ) != rows.end() ) {
+               return false;
+            }
+            rows.emplace( payer, [&]( auto& r ) {
+               r = row;
+            });
+            return true;
+         }
+
+         template<typename F>
+         bool update( uint64_t key, name payer, F&& f )
+         {
+            table rows( _code, _scope );
+            const auto it = rows.find( key );
+            if( it == rows.end() ) {
+               return false;
+            }
+            T row = *it;
+            if( f( row ) ) {
+               rows.modify( it, payer, [&]( auto& r ) {
+                  r = row;
+               });
+            } else {
+               rows.erase( it );
+            }
+            return true;
+         }
+
+         template<typename F>
+         void upsert( const T& initial, name payer, F&& f )
+         {
+            table rows( _code, _scope );
+            const auto it = rows.find( initial.primary_key() );
+            if( it == rows.end() ) {
+               rows.emplace( payer, [&]( auto& r ) {
+                  r = initial;
+                  f( r );
+               });
+            } else {
+               rows.modify( it, same_payer, [&]( auto& r ) {
+                  f( r );
+               });
+            }
+         }
+
+         void erase( uint64_t key )
+         {
+            table rows( _code, _scope );
+            const auto it = rows.find( key );
+            if( it != rows.end() ) {
+               rows.erase( it );
+            }
+         }
+
+         uint64_t available_primary_key()const
+         {
+            table rows( _code, _scope );
+            return rows.available_primary_key();
+         }
+
+         template<typename F>
+         void for_each( F&& f )const
+         {
+            for( cursor it( _code, _scope ); it.valid(); it.next() ) {
+               f( *it );
+            }
+         }
+
+         template<typename F>
+         void update_each( F&& f, name payer )
+         {
+            cursor it( _code, _scope );
+            while( it.valid() ) {
+               T row = *it;
+               if( f( row ) ) {
+                  it.update( row, payer );
+                  it.next();
+               } else {
+                  it.erase();
+               }
+            }
+         }
+
+         template<typename F>
+         void erase_if( F&& f )
+         {
+            cursor it( _code, _scope );
+            while( it.valid() ) {
+               if( f( *it ) ) {
+                  it.erase();
+               } else {
+                  it.next();
+               }
+            }
+         }
+
+      private:
+         typedef multi_index<TableName, T> table;
+         typedef table_cursor<TableName, T> cursor;
+
+         name       _code;
+         uint64_t   _scope;
+   };
+
+   // up to Capacity entries per row, sorted by key. Page must have
+   //
+   //    uint64_t         first;   // lowest key the page can hold, and its primary key
+   //    std::vector<T>   entries;
+   //
+   // a key's entry is in the last page whose first is not above the key.
+   // the first page has first 0 and is never removed, so every key has a
+   // page once any exist. pages split in half when they overflow. underfull
+   // pages are not merged.
+   template<name::raw TableName, typename Page, size_t Capacity>
+   class paged_store {
+      public:
+         typedef typename decltype(Page::entries)::value_type T;
+
+         paged_store( name code, uint64_t scope )
+         :_code(code), _scope(scope) {}
+
+         bool find( uint64_t key, T& row )const
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, key );
+            if( page == pages.end() ) {
+               return false;
+            }
+
+            const auto& entries = page->entries;
+            const auto entry = lower_bound( entries, key );
+            if( entry == entries.end() || entry->primary_key() != key ) {
+               return false;
+            }
+            row = *entry;
+            return true;
+         }
+
+         void store( const T& row, name payer )
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, row.primary_key() );
+            if( page == pages.end() ) {
+               create_first_page( pages, row, payer );
+               return;
+            }
+
+            std::vector<T> entries = page->entries;
+            const auto entry = lower_bound( entries, row.primary_key() );
+            if( entry != entries.end() && entry->primary_key() == row.primary_key() ) {
+               *entry = row;
+            } else {
+               entries.insert( entry, row );
+            }
+            write_page( pages, page, entries, payer );
+         }
+
+         bool insert( const T& row, name payer )
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, row.primary_key() );
+            if( page == pages.end() ) {
+               create_first_page( pages, row, payer );
+               return true;
+            }
+
+            std::vector<T> entries = page->entries;
+            const auto entry = lower_bound( entries, row.primary_key() );
+            if( entry != entries.end() && entry->primary_key() == row.primary_key() ) {
+               return false;
+            }
+            entries.insert( entry, row );
+            write_page( pages, page, entries, payer );
+            return true;
+         }
+
+         template<typename F>
+         bool update( uint64_t key, name payer, F&& f )
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, key );
+            if( page == pages.end() ) {
+               return false;
+            }
+
+            std::vector<T> entries = page->entries;
+            const auto entry = lower_bound( entries, key );
+            if( entry == entries.end() || entry->primary_key() != key ) {
+               return false;
+            }
+            if( !f( *entry ) ) {
+               entries.erase( entry );
+            }
+            write_page( pages, page, entries, payer );
+            return true;
+         }
+
+         template<typename F>
+         void upsert( const T& initial, name payer, F&& f )
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, initial.primary_key() );
+            if( page == pages.end() ) {
+               T row = initial;
+               f( row );
+               create_first_page( pages, row, payer );
+               return;
+            }
+
+            std::vector<T> entries = page->entries;
+            const auto entry = lower_bound( entries, initial.primary_key() );
+            if( entry != entries.end() && entry->primary_key() == initial.primary_key() ) {
+               f( *entry );
+               write_page( pages, page, entries, same_payer );
+            } else {
+               T row = initial;
+               f( row );
+               entries.insert( entry, row );
+               write_page( pages, page, entries, payer );
+            }
+         }
+
+         void erase( uint64_t key )
+         {
+            table pages( _code, _scope );
+            const auto page = page_of( pages, key );
+            if( page == pages.end() ) {
+               return;
+            }
+
+            std::vector<T> entries = page->entries;
+            const auto entry = lower_bound( entries, key );
+            if( entry == entries.end() || entry->primary_key() != key ) {
+               return;
+            }
+            entries.erase( entry );
+            write_page( pages, page, entries, same_payer );
+         }
+
+         uint64_t available_primary_key()const
+         {
+            table pages( _code, _scope );
+            auto page = pages.end();
+            if( page == pages.begin() ) {
+               // no pages
+               return 0;
+            }
+            --page;
+
+            // only the first page can be empty
+            if( page->entries.empty() ) {
+               return page->first;
+            }
+            return page->entries.back().primary_key() + 1;
+         }
+
+         template<typename F>
+         void for_each( F&& f )const
+         {
+            for( cursor page( _code, _scope ); page.valid(); page.next() ) {
+               for( const auto& entry : page->entries ) {
+                  f( entry );
+               }
+            }
+         }
+
+         template<typename F>
+         void update_each( F&& f, name payer )
+         {
+            cursor page( _code, _scope );
+            while( page.valid() ) {
+               Page p = *page;
+
+               // keep the entries f returns true for, in place
+               size_t kept = 0;
+               for( size_t i = 0; i < p.entries.size(); i++ ) {
+                  if( f( p.entries[i] ) ) {
+                     if( kept != i ) {
+                        p.entries[kept] = p.entries[i];
+                     }
+                     ++kept;
+                  }
+               }
+               p.entries.resize( kept );
+
+               if( p.entries.empty() && p.first != 0 ) {
+                  page.erase();
+               } else {
+                  page.update( p, payer );
+                  page.next();
+               }
+            }
+         }
+
+         template<typename F>
+         void erase_if( F&& f )
+         {
+            cursor page( _code, _scope );
+            while( page.valid() ) {
+               Page p = *page;
+
+               size_t kept = 0;
+               for( size_t i = 0; i < p.entries.size(); i++ ) {
+                  if( !f( p.entries[i] ) ) {
+                     if( kept != i ) {
+                        p.entries[kept] = p.entries[i];
+                     }
+                     ++kept;
+                  }
+               }
+
+               if( kept == p.entries.size() ) {
+                  // nothing erased
+                  page.next();
+                  continue;
+               }
+               p.entries.resize( kept );
+
+               if( p.entries.empty() && p.first != 0 ) {
+                  page.erase();
+               } else {
+                  page.update( p, same_payer );
+                  page.next();
+               }
+            }
+         }
+
+      private:
+         typedef multi_index<TableName, Page> table;
+         typedef table_cursor<TableName, Page> cursor;
+         typedef typename table::const_iterator page_iterator;
+
+         // the page that holds key, or end() if there are no pages
+         static page_iterator page_of( const table& pages, uint64_t key )
+         {
+            auto page = pages.upper_bound( key );
+            if( page == pages.begin() ) {
+               return pages.end();
+            }
+            return --page;
+         }
+
+         static void create_first_page( table& pages, const T& row, name payer )
+         {
+            pages.emplace( payer, [&]( auto& p ) {
+               p.first = 0;
+               p.entries.push_back( row );
+            });
+         }
+
+         // stores a page's changed entries. the page is split in half if it
+         // overflows, and removed if it empties, unless it is the first.
+         static void write_page( table& pages, page_iterator page, std::vector<T>& entries, name payer )
+         {
+            if( entries.empty() && page->first != 0 ) {
+               pages.erase( page );
+               return;
+            }
+
+            if( entries.size() > Capacity ) {
+               // split. the upper half goes to a new page.
+               const auto middle = entries.begin() + entries.size() / 2;
+               pages.emplace( payer, [&]( auto& p ) {
+                  p.first = middle->primary_key();
+                  p.entries.assign( middle, entries.end() );
+               });
+               entries.erase( middle, entries.end() );
+            }
+
+            pages.modify( page, payer, [&]( auto& p ) {
+               p.entries = entries;
+            });
+         }
+
+         template<typename Entries>
+         static auto lower_bound( Entries& entries, uint64_t key )
+         {
+            return std::lower_bound( entries.begin(), entries.end(), key, []( const T& entry, uint64_t k ) {
+               return entry.primary_key() < k;
+            });
+         }
+
+         name       _code;
+         uint64_t   _scope;
+   };
+
+   // the leading fields of a singleton's value, read into Prefix without
+   // copying or deserializing the rest of the row. Prefix must declare the
+   // same leading fields in the same order, and they must fit in MaxSize
+   // bytes.
+   //
+   // set() writes a new prefix through the iterator found on construction,
+   // and copies the rest of the row through unchanged, so a changed prefix
+   // costs no second lookup. as with table_cursor, don't mix it with a live
+   // singleton over the same row.
+   template<name::raw SingletonName, typename Prefix, size_t MaxSize>
+   class singleton_prefix {
+      public:
+         singleton_prefix( name code, uint64_t scope )
+         {
+            const uint64_t key = static_cast<uint64_t>(SingletonName);
+            _itr = db_find_i64( code.value, scope, key, key );
+            if( _itr < 0 ) {
+               return;
+            }
+
+            char buffer[MaxSize];
+            const int32_t size = db_get_i64( _itr, buffer, MaxSize );
+            datastream<const char*> ds( buffer, size < int32_t(MaxSize) ? size : MaxSize );
+            ds >> _prefix;
+            _prefix_size = ds.tellp();
+         }
+
+         bool exists()const { return _itr >= 0; }
+
+         const Prefix& get()const
+         {
+            eosio_assert( exists(), "singleton does not exist" );
+            return _prefix;
+         }
+
+         void set( const Prefix& prefix, name payer )
+         {
+            eosio_assert( exists(), "singleton does not exist" );
+
+            const size_t size = db_get_i64( _itr, nullptr, 0 );
+            std::vector<char> row( size );
+            db_get_i64( _itr, row.data(), size );
+
+            const size_t prefix_size = pack_size( prefix );
+            eosio_assert( prefix_size <= MaxSize, "singleton prefix too large" );
+            const size_t rest_size = size - _prefix_size;
+            std::vector<char> buffer( prefix_size + rest_size );
+            datastream<char*> ds( buffer.data(), buffer.size() );
+            ds << prefix;
+            ds.write( row.data() + _prefix_size, rest_size );
+            db_update_i64( _itr, payer.value, buffer.data(), buffer.size() );
+
+            _prefix = prefix;
+            _prefix_size = prefix_size;
+         }
+
+      private:
+         int32_t    _itr;
+         Prefix     _prefix;
+         size_t     _prefix_size = 0;
+   };
+
+} /// namespace eosio
@@ -0,0 +1,85 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE.txt
+ */
+#pragma once
+
+#include <eosiolib/datastream.hpp>
+#include <eosiolib/db.h>
+#include <eosiolib/eosio.hpp>
+
+#include <vector>
+
+namespace eosio {
+
+   // forward cursor over the primary index of a table, for bulk scans.
+   // unlike multi_index, it deserializes one row at a time into a single slot
+   // and caches nothing, so a full scan runs in constant memory.
+   //
+   // update() and erase() write through the db directly. don't use them on
+   // rows that a live multi_index over the same table has already loaded,
+   // because its cached copy would go stale.
+   template<name::raw TableName, typename T>
+   class table_cursor {
+      public:
+         table_cursor( name code, uint64_t scope, uint64_t lower_bound = 0 )
+         {
+            _itr = db_lowerbound_i64( code.value, scope, static_cast<uint64_t>(TableName), lower_bound );
+            load();
+         }
+
+         bool valid()const { return _itr >= 0; }
+
+         const T& operator*()const { return _row; }
+         const T* operator->()const { return &_row; }
+
+         void next()
+         {
+            uint64_t pk;
+            _itr = db_next_i64( _itr, &pk );
+            load();
+         }
+
+         // writes row over the current row. the primary key must not change.
+         void update( const T& row, name payer )
+         {
+            eosio_assert( row.primary_key() == _row.primary_key(), "cursor cannot change primary key" );
+
+            const size_t size = pack_size( row );
+            _buffer.resize( size );
+            datastream<char*> ds( _buffer.data(), size );
+            ds << row;
+            db_update_i64( _itr, payer.value, _buffer.data(), size );
+
+            _row = row;
+         }
+
+         // removes the current row and moves to the next one.
+         void erase()
+         {
+            uint64_t pk;
+            const int32_t next_itr = db_next_i64( _itr, &pk );
+            db_remove_i64( _itr );
+            _itr = next_itr;
+            load();
+         }
+
+      private:
+         void load()
+         {
+            if( _itr < 0 ) {
+               return;
+            }
+            const int32_t size = db_get_i64( _itr, nullptr, 0 );
+            _buffer.resize( size );
+            db_get_i64( _itr, _buffer.data(), size );
+            datastream<const char*> ds( _buffer.data(), size );
+            ds >> _row;
+         }
+
+         int32_t            _itr;
+         T                  _row;
+         std::vector<char>  _buffer; // reused for every row
+   };
+
+} /// namespace eosio
@@ -7,6 +7,8 @@
 #include <eosiolib/transaction.hpp>
 #include <math.h> /* exp */
 
+#include <algorithm>
+
 namespace eosio {
 
 void token::create( asset  maximum_supply )
@@ -29,9 +31,17 @@ void token::create( asset  maximum_supply )
        s.max_supply    = maximum_supply;
        s.created       = current_time;
        s.updated       = current_time;
-       s.boosts        = 0;
     });
 
+    global_state state;
+    state.transfer.token_symbol = sym;
+    state.transfer.tier_stakes.assign( stake_count, 0 );
+    state.created = current_time;
+    state.boosts = 0;
+    state.next_boost = current_time + boost_interval;
+    global_state_singleton global( _self, sym.code().raw() );
+    global.set( state, _self );
+
     const int64_t issue_amount = (int64_t)(maximum_supply.amount * ISSUE_PROPORTION);
     issue(asset(issue_amount, sym));
 }
@@ -44,22 +54,30 @@ void token::transfer( name    from,
     eosio_assert( from != to, "cannot transfer to self" );
     require_auth( from );
     eosio_assert( is_account( to ), "to account does not exist");
-    auto sym = quantity.symbol.code();
-    stats statstable( _self, sym.raw() );
-    const auto& st = statstable.get( sym.raw() );
+    transfer_state_prefix global( _self, quantity.symbol.code().raw() );
+    eosio_assert( global.exists(), "token with symbol does not exist" );
+    transfer_state state = global.get();
 
     require_recipient( from );
     require_recipient( to );
 
     eosio_assert( quantity.is_valid(), "invalid quantity" );
     eosio_assert( quantity.amount > 0, "must transfer positive quantity" );
-    eosio_assert( quantity.symbol == st.supply.symbol, "symbol precision mismatch" );
+    eosio_assert( quantity.symbol == state.token_symbol, "symbol precision mismatch" );
     eosio_assert( memo.size() <= 256, "memo has more than 256 bytes" );
 
     auto payer = has_auth( to ) ? to : from;
 
-    sub_balance( from, quantity );
+    const fee_result fees = sub_balance( from, quantity, state.tier_stakes );
+    if( fees.expired_stakes > 0 ) {
+       // the sender's expired stakes came off the stake totals
+       global.set( state, _self );
+    }
     add_balance( to, quantity, payer );
+
+    SEND_INLINE_ACTION( *this, xferresult, { {_self, "active"_n} },
+                        { from, to, quantity, fees.fee, fees.to_stakers, fees.to_self, fees.expired_stakes }
+    );
 }
 
 void token::transferstkd( name    from,
@@ -72,7 +90,8 @@ void token::transferstkd( name    from,
                        { from, to, quantity, memo }
    );
    // can't use the addstake action, because we don't have the authority
-   add_stake(to, quantity, duration_index);
+   const stake_result result = add_stake(to, quantity, duration_index);
+   send_stake_result(to, result);
 }
 
 void token::issue( asset quantity )
@@ -98,76 +117,118 @@ void token::issue( asset quantity )
     add_balance( _self, quantity, _self );
 }
 
-void token::sub_balance( name owner, asset value ) {
-   accounts from_acnts( _self, owner.value );
-
-   const auto& from = from_acnts.get( value.symbol.code().raw(), "no balance object found" );
+// tier_stakes are the stake totals. if the owner's expired stakes are
+// released, they are taken off, and the caller stores them.
+token::fee_result token::sub_balance( name owner, asset value, std::vector<int64_t>& tier_stakes ) {
+   // release the owner's expired stakes first, so their funds are available now
+   stake_stat stat;
+   const uint32_t expired_stakes = expire_stakes(owner, value.symbol, stat, tier_stakes);
+   if (expired_stakes > 0) {
+      store_stake_stat( stat );
+   }
 
-   const asset stake = get_stake(owner, value.symbol );
+   const asset stake = stat.total_stake;
 
    const int64_t transaction_fee_amount = (int64_t)(value.amount * transaction_fee);
    const int64_t total_amount = value.amount + transaction_fee_amount;
 
-   eosio_assert( from.balance.amount - stake.amount >= total_amount, "overdrawn unstaked balance" );
-
-   from_acnts.modify( from, owner, [&]( auto& a ) {
-         a.balance.amount -= total_amount;
-      });
+   account_store from_acnts( _self, owner.value );
+   const bool found = from_acnts.update( value.symbol.code().raw(), owner, [&]( account& a ) {
+      eosio_assert( a.balance.amount - stake.amount >= total_amount, "overdrawn unstaked balance" );
+      a.balance.amount -= total_amount;
+      return true;
+   });
+   eosio_assert( found, "no balance object found" );
 
    int64_t transaction_fee_remaining = transaction_fee_amount;
    const int64_t transaction_fee_stakers_amount = (int64_t)(transaction_fee_to_stakers * transaction_fee_amount);
    asset transaction_fee_stakers_asset(transaction_fee_stakers_amount, value.symbol);
 
-   transaction_fee_remaining -= distribute(transaction_fee_stakers_asset);
+   const int64_t transaction_fee_distributed = distribute(transaction_fee_stakers_asset, tier_stake_weight(tier_stakes));
+   transaction_fee_remaining -= transaction_fee_distributed;
+
+   fee_result result;
+   result.fee = asset(transaction_fee_amount, value.symbol);
+   result.to_stakers = asset(transaction_fee_distributed, value.symbol);
+   result.to_self = asset(0, value.symbol);
+   result.expired_stakes = expired_stakes;
 
    if (transaction_fee_remaining > 0) {
       asset transaction_fee_inspace_asset(transaction_fee_remaining, value.symbol);
-      add_balance(_self, transaction_fee_inspace_asset, _self);
+      add_to_fee_sink(owner, transaction_fee_inspace_asset);
+      result.to_self = transaction_fee_inspace_asset;
    }
+
+   return result;
 }
 
 void token::add_balance( name owner, asset value, name ram_payer )
 {
-   accounts to_acnts( _self, owner.value );
-   auto to = to_acnts.find( value.symbol.code().raw() );
-   if( to == to_acnts.end() ) {
-      to_acnts.emplace( ram_payer, [&]( auto& a ){
-        a.balance = value;
-      });
-   } else {
-      to_acnts.modify( to, same_payer, [&]( auto& a ) {
-        a.balance += value;
-      });
-   }
+   account_store to_acnts( _self, owner.value );
+   to_acnts.upsert( account{ asset(0, value.symbol) }, ram_payer, [&]( account& a ) {
+      a.balance += value;
+   });
 }
 
 void token::open( name owner, const symbol& symbol, name ram_payer )
 {
    require_auth( ram_payer );
 
-   auto sym_code_raw = symbol.code().raw();
+   check_symbol( symbol );
+   open_balance( owner, symbol, ram_payer );
+}
+
+void token::close( name owner, const symbol& symbol )
+{
+   close_balance( owner, symbol );
+}
 
-   stats statstable( _self, sym_code_raw );
-   const auto& st = statstable.get( sym_code_raw, "symbol does not exist" );
-   eosio_assert( st.supply.symbol == symbol, "symbol precision mismatch" );
+void token::openmany( std::vector<name> owners, const symbol& symbol, name ram_payer )
+{
+   require_auth( ram_payer );
 
-   accounts acnts( _self, owner.value );
-   auto it = acnts.find( sym_code_raw );
-   if( it == acnts.end() ) {
-      acnts.emplace( ram_payer, [&]( auto& a ){
-        a.balance = asset{0, symbol};
-      });
+   check_symbol( symbol );
+
+   std::sort( owners.begin(), owners.end() );
+   owners.erase( std::unique( owners.begin(), owners.end() ), owners.end() );
+
+   for( const name owner : owners ) {
+      open_balance( owner, symbol, ram_payer );
    }
 }
 
-void token::close( name owner, const symbol& symbol )
+void token::closemany( std::vector<name> owners, const symbol& symbol )
+{
+   std::sort( owners.begin(), owners.end() );
+   owners.erase( std::unique( owners.begin(), owners.end() ), owners.end() );
+
+   for( const name owner : owners ) {
+      close_balance( owner, symbol );
+   }
+}
+
+void token::check_symbol( const symbol& symbol )
+{
+   const transfer_state_prefix global( _self, symbol.code().raw() );
+   eosio_assert( global.exists(), "token with symbol does not exist" );
+   eosio_assert( global.get().token_symbol == symbol, "symbol precision mismatch" );
+}
+
+void token::open_balance( name owner, const symbol& symbol, name ram_payer )
+{
+   account_store acnts( _self, owner.value );
+   acnts.insert( account{ asset{0, symbol} }, ram_payer );
+}
+
+void token::close_balance( name owner, const symbol& symbol )
 {
    require_auth( owner );
-   accounts acnts( _self, owner.value );
-   auto it = acnts.find( symbol.code().raw() );
-   eosio_assert( it != acnts.end(), "Balance row already deleted or never existed. Action won't have any effect." );
-   eosio_assert( it->balance.amount == 0, "Cannot close because the balance is not zero." );
-   acnts.erase( it );
+   account_store acnts( _self, owner.value );
+   const bool found = acnts.update( symbol.code().raw(), same_payer, [&]( const account& a ) {
+      eosio_assert( a.balance.amount == 0, "Cannot close because the balance is not zero." );
+      return false;
+   });
+   eosio_assert( found, "Balance row already deleted or never existed. Action won't have any effect." );
 }
 
 void token::addstake( name         staker,
@@ -175,10 +236,11 @@ void token::addstake( name         staker,
                       size_t       duration_index )
 {
     require_auth( staker );
-    add_stake(staker, quantity, duration_index);
+    const stake_result result = add_stake(staker, quantity, duration_index);
+    send_stake_result(staker, result);
 }
 
-void token::add_stake( name         staker,
+token::stake_result token::add_stake( name         staker,
                       asset        quantity,
                       size_t       duration_index )
 {
@@ -186,53 +248,76 @@ void token::add_stake( name         staker,
 
     eosio_assert( duration_index < stake_count, "duration_index out of bounds");
 
-    stats statstable( _self, quantity.symbol.code().raw() );
-    const auto& st = statstable.get( quantity.symbol.code().raw() );
+    global_state_singleton global( _self, quantity.symbol.code().raw() );
+    global_state state = get_global_state( global );
 
     eosio_assert( quantity.is_valid(), "invalid quantity" );
     eosio_assert( quantity.amount > 0, "must stake positive quantity" );
-    eosio_assert( quantity.symbol == st.supply.symbol, "symbol precision mismatch" );
+    eosio_assert( quantity.symbol == state.transfer.token_symbol, "symbol precision mismatch" );
 
-    const asset unstaked_balance = get_unstaked_balance(staker, quantity.symbol);
-    eosio_assert( quantity.amount <= unstaked_balance.amount, "overdrawn unstaked balance" );
+    stake_result result;
 
-    stakes staker_stakes( _self, staker.value );
-    staker_stakes.emplace(_self, [&](auto& s) {
-      s.id = staker_stakes.available_primary_key();
-      s.quantity = quantity;
-      s.start = eosio::time_point_sec(now());
-      s.duration_index = duration_index;
-   });
+    // release the staker's expired stakes first, so their funds can be restaked
+    stake_stat stat;
+    result.expired_stakes = expire_stakes(staker, quantity.symbol, stat, state.transfer.tier_stakes);
 
-   int64_t weight = stake_weights[duration_index];
+    const asset balance = get_balance(_self, staker, quantity.symbol.code());
+    eosio_assert( quantity.amount <= balance.amount - stat.total_stake.amount, "overdrawn unstaked balance" );
 
-   stake_stats stake_stats_table( _self, quantity.symbol.code().raw() );
-   const auto staker_stake_stats = stake_stats_table.find( staker.value );
-   if( staker_stake_stats == stake_stats_table.end() ) {
-      stake_stats_table.emplace( _self, [&]( auto& s ){
-         s.staker = staker;
-         s.total_stake = quantity;
-         s.stake_weight = weight;
-      });
-   } else {
-      stake_stats_table.modify( staker_stake_stats, _self, [&]( auto& s ) {
-         s.total_stake += quantity;
-         s.stake_weight += weight;
-      });
-   }
+    stake_store staker_stakes( _self, staker.value );
+    stake s;
+    s.id = staker_stakes.available_primary_key();
+    s.quantity = quantity;
+    s.start = eosio::time_point_sec(now());
+    s.duration_index = duration_index;
+    staker_stakes.store( s, _self );
+    result.stake_id = s.id;
+
+   stat.total_stake += quantity;
+   stat.tier_stakes[duration_index] += quantity.amount;
+   store_stake_stat( stat );
+
+   state.transfer.tier_stakes[duration_index] += quantity.amount;
+   global.set( state, _self );
+
+   result.total_stake = stat.total_stake;
+
+   return result;
+}
+
+void token::send_stake_result( name staker, const stake_result& result )
+{
+   SEND_INLINE_ACTION( *this, stakeresult, { {_self, "active"_n} },
+                       { staker, result.stake_id, result.total_stake, result.expired_stakes }
+   );
 }
 
 void token::update( const symbol& symbol ) {
    require_auth( _self );
 
-   eosio::print("Updating\n");
-
    eosio_assert( symbol.is_valid(), "invalid symbol name" );
 
-   update_stakes(symbol);
-   update_boost(symbol);
+   global_state_singleton global( _self, symbol.code().raw() );
+   global_state state = get_global_state( global );
+
+   const uint32_t expired_stakes = update_stakes(symbol, state.transfer.tier_stakes);
+   const boost_result boost = update_boost(symbol, state);
+   const asset fees_merged = merge_fee_sinks(symbol);
+
+   global.set( state, _self );
+
+   SEND_INLINE_ACTION( *this, updateresult, { {_self, "active"_n} },
+                       { expired_stakes, boost.boost, boost.amount, boost.to_stakers, boost.to_self, fees_merged }
+   );
 
    // schedule a transaction to do it again
+   schedule_update( symbol );
+}
+
+// one sender id per symbol, replacing any update already scheduled, so
+// there is never more than one chain of updates for a symbol
+void token::schedule_update( const symbol& symbol )
+{
    eosio::transaction out;
    out.actions.emplace_back(
       permission_level{_self, "active"_n},
@@ -240,192 +325,427 @@ void token::update( const symbol& symbol ) {
       "update"_n,
       std::make_tuple(symbol));
    out.delay_sec = update_interval;
-   out.send(_self.value + now(), _self); // needs a unique sender id so append current time
+   out.send(symbol.code().raw(), _self, true);
 }
 
-void token::update_stakes( const symbol& symbol ) {
+void token::acctsummary( std::vector<name> owners, const symbol& symbol )
+{
+   check_symbol( symbol );
+
+   // results are split over as many acctresult actions as needed to keep
+   // each one under max_inline_action_size
+   std::vector<account_summary> summaries;
+   size_t summaries_size = 0;
+   for( const name owner : owners ) {
+      const account_summary summary = get_account_summary( owner, symbol );
+      const size_t summary_size = pack_size( summary );
+      eosio_assert( summary_size <= account_result_max_size, "account has too many stakes to summarize" );
+
+      if( summaries_size + summary_size > account_result_max_size ) {
+         SEND_INLINE_ACTION( *this, acctresult, { {_self, "active"_n} },
+                             { summaries }
+         );
+         summaries.clear();
+         summaries_size = 0;
+      }
 
-   stake_stats stake_stats_table( _self, symbol.code().raw() );
+      summaries.push_back( summary );
+      summaries_size += summary_size;
+   }
 
-   // iterate through stake stats
-   // (all stakes will have an entry because addstake adds one)
-   auto iterator = stake_stats_table.begin();
-   while ( iterator != stake_stats_table.end() ) {
+   if( !summaries.empty() ) {
+      SEND_INLINE_ACTION( *this, acctresult, { {_self, "active"_n} },
+                          { summaries }
+      );
+   }
+}
 
-      const auto& st = (*iterator);
-      // iterate through the staker's stakes
-      stakes stakestable( _self, st.staker.value );
+// stakes that have expired but haven't been removed yet are left out, and
+// their amount is counted as unstaked, as it would be by the owner's next
+// transfer.
+token::account_summary token::get_account_summary( name owner, const symbol& symbol )const
+{
+   account_summary summary;
+   summary.owner = owner;
 
-      asset total_stake(0, symbol);
+   account_store acnts( _self, owner.value );
+   account acnt;
+   summary.balance = acnts.find( symbol.code().raw(), acnt ) ? acnt.balance : asset(0, symbol);
 
-      int64_t this_stake_weight = 0;
+   stake_stat stat;
+   if( find_stake_stat( owner, symbol, stat ) ) {
+      summary.staked = stat.total_stake;
+      summary.stake_weight = tier_stake_weight(stat.tier_stakes);
+   } else {
+      summary.staked = asset(0, symbol);
+      summary.stake_weight = 0;
+   }
 
+   if ( summary.staked.amount > 0 ) {
       const eosio::time_point_sec currentTime(now());
-      auto stake_iterator = stakestable.begin();
-      while(stake_iterator != stakestable.end()) {
-         const auto& stk = (*stake_iterator);
+
+      const stake_store owner_stakes( _self, owner.value );
+      owner_stakes.for_each( [&]( const stake& stk ) {
          if (stk.quantity.symbol != symbol) {
-            ++stake_iterator;
-            continue;
+            return;
          }
-         const uint32_t duration = stake_durations[stk.duration_index];
-         const eosio::time_point_sec expiryTime = stk.start + duration;
-         if (expiryTime <= currentTime) {
-            // stake has expired. remove it.
-            stake_iterator = stakestable.erase(stake_iterator);
+         const eosio::time_point_sec expires = stake_expiry(stk);
+         if (expires <= currentTime) {
+            summary.staked -= stk.quantity;
+            summary.stake_weight -= stake_weights[stk.duration_index] * stk.quantity.amount;
          } else {
-            total_stake.amount += stk.quantity.amount;
+            summary.stakes.push_back( stake_summary{ stk.id, stk.quantity, stk.duration_index, expires } );
+         }
+      });
+   }
 
-            int64_t weight = stake_weights[stk.duration_index] * stk.quantity.amount;
-            this_stake_weight += weight;
+   summary.unstaked = summary.balance - summary.staked;
 
-            ++stake_iterator;
-         }
-      }
+   return summary;
+}
+
+// loads the staker's stake stat into stat, or an empty one if they have no
+// stakes. then removes their expired stakes of the symbol and takes them off
+// stat and the stake totals in tier_stakes, which the caller stores, so that
+// it can reuse stat. costs a scan of the staker's own stakes only.
+// returns the number of stakes removed.
+uint32_t token::expire_stakes( name staker, const symbol& symbol, stake_stat& stat, std::vector<int64_t>& tier_stakes ) {
+
+   if( !find_stake_stat( staker, symbol, stat ) ) {
+      // no stakes
+      stat.staker = staker;
+      stat.total_stake = asset(0, symbol);
+      stat.tier_stakes.assign( stake_count, 0 );
+      return 0;
+   }
+   stat.tier_stakes.resize( stake_count );
+
+   uint32_t expired_stakes = 0;
+
+   const eosio::time_point_sec currentTime(now());
 
-      if (total_stake.amount == 0) {
-         // all stakes have expired.
-         // remove entry
-         iterator = stake_stats_table.erase(iterator);
-      } else {
-         // update stake stats
-         stake_stats_table.modify( iterator, _self, [&]( auto& s ) {
-            s.total_stake = total_stake;
-            s.stake_weight = this_stake_weight;
-         });
-         ++iterator;
+   std::vector<int64_t> expired_tier_stakes( stake_count, 0 );
+
+   stake_store staker_stakes( _self, staker.value );
+   staker_stakes.erase_if( [&]( const stake& stk ) {
+      if (stk.quantity.symbol == symbol && stake_expiry(stk) <= currentTime) {
+         expired_tier_stakes[stk.duration_index] += stk.quantity.amount;
+         ++expired_stakes;
+         return true;
       }
+      return false;
+   });
+
+   if (expired_stakes == 0) {
+      return 0;
+   }
+
+   for( size_t i = 0; i < stake_count; i++ ) {
+      stat.tier_stakes[i] -= expired_tier_stakes[i];
+      stat.total_stake.amount -= expired_tier_stakes[i];
+      tier_stakes[i] -= expired_tier_stakes[i];
    }
+
+   return expired_stakes;
 }
 
+// recalculates the staker's stake stat from their stakes of the symbol,
+// removing the expired ones, and adds the live amounts to tier_stakes.
+// returns the number of stakes removed.
+uint32_t token::rescan_stakes( stake_stat& st, const symbol& symbol, std::vector<int64_t>& tier_stakes ) {
+
+   uint32_t expired_stakes = 0;
+
+   const eosio::time_point_sec currentTime(now());
+
+   asset total_stake(0, symbol);
+
+   st.tier_stakes.assign( stake_count, 0 );
 
-void token::update_boost( const symbol& symbol ) {
+   stake_store staker_stakes( _self, st.staker.value );
+   staker_stakes.erase_if( [&]( const stake& stk ) {
+      if (stk.quantity.symbol != symbol) {
+         return false;
+      }
+      if (stake_expiry(stk) <= currentTime) {
+         // stake has expired. remove it.
+         ++expired_stakes;
+         return true;
+      }
+
+      total_stake.amount += stk.quantity.amount;
+
+      st.tier_stakes[stk.duration_index] += stk.quantity.amount;
+      tier_stakes[stk.duration_index] += stk.quantity.amount;
+
+      return false;
+   });
+
+   st.total_stake = total_stake;
+
+   return expired_stakes;
+}
+
+// removes expired stakes and recalculates stake stats, and the stake
+// totals into tier_stakes.
+// returns the number of stakes removed.
+uint32_t token::update_stakes( const symbol& symbol, std::vector<int64_t>& tier_stakes ) {
+
+   uint32_t expired_stakes = 0;
+
+   tier_stakes.assign( stake_count, 0 );
+
+   // iterate through stake stats
+   // (all stakes will have an entry because addstake adds one)
+   stake_stat_store store( _self, symbol.code().raw() );
+   store.update_each( [&]( stake_stat& st ) {
+      expired_stakes += rescan_stakes( st, symbol, tier_stakes );
+
+      // (if all stakes have expired, the entry is removed)
+      return st.total_stake.amount != 0;
+   }, _self );
+
+   return expired_stakes;
+}
+
+void token::migrstakes( const symbol& symbol, uint32_t max_rows ) {
    require_auth( _self );
 
-   eosio::print("Updating boost.\n");
+   eosio_assert( symbol.is_valid(), "invalid symbol name" );
+
+   // the stake totals are rebuilt by the next update
+   std::vector<int64_t> tier_stakes( stake_count, 0 );
 
-   stats statstable( _self, symbol.code().raw() );
-   auto existing = statstable.find( symbol.code().raw() );
-   eosio_assert( existing != statstable.end(), "token with symbol does not exist." );
-   const auto& st = *existing;
+   uint32_t migrated = 0;
+   legacy_stake_stat_cursor legacy( _self, symbol.code().raw() );
+   while ( legacy.valid() && migrated < max_rows ) {
+      stake_stat st;
+      st.staker = legacy->staker;
+      rescan_stakes( st, symbol, tier_stakes );
+      store_stake_stat( st );
+
+      legacy.erase();
+      ++migrated;
+   }
+}
+
+void token::migrglobal( const symbol& symbol ) {
+   require_auth( _self );
+
+   eosio_assert( symbol.is_valid(), "invalid symbol name" );
+
+   const uint64_t scope = symbol.code().raw();
+
+   global_state_singleton global( _self, scope );
+   eosio_assert( !global.exists(), "global state already exists" );
+
+   // the stake totals are summed from stakertiers
+   const legacy_stake_stat_cursor legacy( _self, scope );
+   eosio_assert( !legacy.valid(), "migrate stake stats first" );
+
+   const legacy_stats_cursor st( _self, scope, scope );
+   eosio_assert( st.valid() && st->primary_key() == scope, "token with symbol does not exist" );
+   eosio_assert( st->supply.symbol == symbol, "symbol precision mismatch" );
+
+   global_state state;
+   state.transfer.token_symbol = symbol;
+   state.created = st->created;
+   state.boosts = st->boosts;
+   state.next_boost = st->created + (st->boosts + 1) * boost_interval;
+
+   state.transfer.tier_stakes.assign( stake_count, 0 );
+   const stake_stat_store store( _self, scope );
+   store.for_each( [&]( const stake_stat& stat ) {
+      for( size_t i = 0; i < stat.tier_stakes.size() && i < stake_count; i++ ) {
+         state.transfer.tier_stakes[i] += stat.tier_stakes[i];
+      }
+   });
+
+   // (the old boosts field in stat is dropped the next time the row is written)
+   global.set( state, _self );
+
+   // an update scheduled before the upgrade fails without the global row,
+   // which ends the chain of updates. start it again.
+   schedule_update( symbol );
+}
+
+
+// releases the next boost if it is due. the boost counter and next boost
+// time are kept in state, so stats are only read when a boost is released.
+token::boost_result token::update_boost( const symbol& symbol, global_state& state ) {
+   require_auth( _self );
+
+   boost_result result;
+   result.boost = 0;
+   result.amount = asset(0, symbol);
+   result.to_stakers = asset(0, symbol);
+   result.to_self = asset(0, symbol);
 
    const eosio::time_point_sec current_time(now());
-   eosio::print("Current time:", current_time.sec_since_epoch(), "\n");
 
-   const uint16_t next_boost = st.boosts + 1;
-   eosio::print("Current boost:", (uint32_t)st.boosts, "\n");
-   eosio::print("Next boost:", (uint32_t)next_boost, "\n");
+   const uint16_t next_boost = state.boosts + 1;
 
    if (next_boost > boost_count) {
       // no more boosts
-      return;
+      return result;
    }
 
-   const eosio::time_point_sec next_boost_time = st.created + next_boost * boost_interval;
-   eosio::print("Next boost time:", next_boost_time.sec_since_epoch(), "\n");
-
-   if (next_boost_time <= current_time) {
+   if (state.next_boost <= current_time) {
       // it's time for the next boost
 
+      stats statstable( _self, symbol.code().raw() );
+      auto existing = statstable.find( symbol.code().raw() );
+      eosio_assert( existing != statstable.end(), "token with symbol does not exist." );
+      const auto& st = *existing;
+
       const int64_t total_boost = (int64_t)(boost_proportion() * st.max_supply.amount);
-      eosio::print("Total boost:", total_boost, "\n");
       const int64_t current_boost_amount = (exp(boost_lambda*next_boost)/boost_divisor) * total_boost;
-      eosio::print("Current boost:", current_boost_amount, "\n");
       const asset current_boost_asset(current_boost_amount, symbol);
 
       if ( st.supply.amount + current_boost_asset.amount > st.max_supply.amount) {
          // not enough supply
-         return;
+         return result;
       }
 
       statstable.modify( st, same_payer, [&]( auto& s ) {
          s.supply += current_boost_asset;
          s.updated = current_time;
-         s.boosts = next_boost;
       });
 
-      int64_t amount_distributed = distribute(current_boost_asset);
-      eosio::print("Amount distributed:", amount_distributed, "\n");
+      state.boosts = next_boost;
+      state.next_boost = state.created + (next_boost + 1) * boost_interval;
+
+      int64_t amount_distributed = distribute(current_boost_asset, tier_stake_weight(state.transfer.tier_stakes));
       // give remainder to this account
       int64_t remainder = current_boost_asset.amount - amount_distributed;
-      eosio::print("Remainder:", remainder, "\n");
       if (remainder > 0) {
          add_balance( _self, asset(remainder, symbol), _self);
       }
+
+      result.boost = next_boost;
+      result.amount = current_boost_asset;
+      result.to_stakers = asset(amount_distributed, symbol);
+      result.to_self = asset(remainder > 0 ? remainder : 0, symbol);
    }
+
+   return result;
 }
 
-asset token::get_stake( name staker, const symbol& symbol )const
+token::global_state token::get_global_state( global_state_singleton& global )
 {
-   stake_stats stake_stats_table( _self, symbol.code().raw() );
-   const auto staker_stake_stats = stake_stats_table.find( staker.value );
-   if( staker_stake_stats == stake_stats_table.end() ) {
-      // no enty, so no stakes
-      asset ret(0, symbol);
-      return ret;
-   } else {
-      return (*staker_stake_stats).total_stake;
-   }
+   eosio_assert( global.exists(), "token with symbol does not exist" );
+   return global.get();
 }
 
-int64_t token::get_stake_weight( name staker, const symbol& symbol )const
+void token::add_to_fee_sink( name sender, asset value )
 {
-   stake_stats stake_stats_table( _self, symbol.code().raw() );
-   const auto staker_stake_stats = stake_stats_table.find( staker.value );
-   if( staker_stake_stats == stake_stats_table.end() ) {
-      // no enty, so no stakes
-      return (int64_t)0;
+   // fibonacci hashing. the low bits of a name are zero for most names,
+   // so they can't be used directly.
+   const uint64_t shard = (sender.value * 0x9E3779B97F4A7C15ull) >> (64 - fee_sink_shard_bits);
+
+   fee_sinks sinks( _self, value.symbol.code().raw() );
+   auto sink = sinks.find( shard );
+   if( sink == sinks.end() ) {
+      sinks.emplace( _self, [&]( auto& s ){
+        s.shard = shard;
+        s.balance = value;
+      });
    } else {
-      return (*staker_stake_stats).stake_weight;
+      sinks.modify( sink, same_payer, [&]( auto& s ) {
+        s.balance += value;
+      });
    }
 }
 
-asset token::get_unstaked_balance( name owner, const symbol& symbol )const
-{
-   const asset balance = get_balance(_self, owner, symbol.code());
-   const asset stake = get_stake(owner, symbol);
-   return asset(balance.amount - stake.amount, symbol);
-}
-
-// distributes the quantity amongst stakers by stake weight.
-// returns the actual amount distruted.
-int64_t token::distribute( asset quantity )
+// moves everything in the fee sinks to this account's balance.
+// the rows are kept, so they are not re-created by the next transfers.
+// returns the amount moved.
+asset token::merge_fee_sinks( const symbol& symbol )
 {
-   eosio::print("Distributing:", quantity.amount, "\n");
+   asset total(0, symbol);
 
-   stake_stats stake_stats_table( _self, quantity.symbol.code().raw() );
+   fee_sinks sinks( _self, symbol.code().raw() );
+   for( auto sink = sinks.begin(); sink != sinks.end(); ++sink ) {
+      if( sink->balance.amount == 0 ) {
+         continue;
+      }
+      total += sink->balance;
+      sinks.modify( sink, same_payer, [&]( auto& s ) {
+        s.balance.amount = 0;
+      });
+   }
 
-   std::vector<name>  stakers;
-   std::vector<int64_t>       weights;
-   int64_t                    total_weight = 0;
+   if( total.amount > 0 ) {
+      add_balance( _self, total, _self );
+   }
 
-   // iterate through stake stats
-   auto iterator = stake_stats_table.begin();
-   while ( iterator != stake_stats_table.end() ) {
+   return total;
+}
 
-      const auto& st = (*iterator);
+// paging is off by default, so nothing else instantiates the paged
+// backend. instantiate it here so that the mode always compiles.
+template class paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >;
+template void paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >::
+   for_each< void (*)( const token::stake_stat& ) >( void (*&&)( const token::stake_stat& ) )const;
+template void paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >::
+   update_each< bool (*)( token::stake_stat& ) >( bool (*&&)( token::stake_stat& ), name );
+template void paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >::
+   erase_if< bool (*)( const token::stake_stat& ) >( bool (*&&)( const token::stake_stat& ) );
+template bool paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >::
+   update< bool (*)( token::stake_stat& ) >( uint64_t, name, bool (*&&)( token::stake_stat& ) );
+template void paged_store< "stakepages"_n, token::stake_stat_page, token::stake_stat_page_capacity >::
+   upsert< void (*)( token::stake_stat& ) >( const token::stake_stat&, name, void (*&&)( token::stake_stat& ) );
+
+bool token::find_stake_stat( name staker, const symbol& symbol, stake_stat& stat )const
+{
+   stake_stat_store store( _self, symbol.code().raw() );
+   return store.find( staker.value, stat );
+}
 
-      stakers.push_back(st.staker);
-      weights.push_back(st.stake_weight);
-      total_weight += st.stake_weight;
+void token::store_stake_stat( const stake_stat& stat )
+{
+   stake_stat_store store( _self, stat.total_stake.symbol.code().raw() );
+   if ( stat.total_stake.amount == 0 ) {
+      store.erase( stat.staker.value );
+   } else {
+      store.store( stat, _self );
+   }
+}
 
-      ++iterator;
+int64_t token::tier_stake_weight( const std::vector<int64_t>& tier_stakes )const
+{
+   int64_t weight = 0;
+   for( size_t i = 0; i < tier_stakes.size() && i < stake_count; i++ ) {
+      weight += stake_weights[i] * tier_stakes[i];
    }
+   return weight;
+}
 
+// distributes the quantity amongst stakers by stake weight.
+// returns the actual amount distruted.
+// total_weight is the weight of the stake totals, so the stake stats
+// only need one streaming pass.
+int64_t token::distribute( asset quantity, int64_t total_weight )
+{
    if (total_weight == 0) {
       return 0;
    }
 
    int64_t amount_distributed = 0;
 
-   for(size_t i = 0; i < stakers.size(); i++) {
-      name staker = stakers[i];
+   stake_stat_store store( _self, quantity.symbol.code().raw() );
+   store.for_each( [&]( const stake_stat& st ) {
+      name staker = st.staker;
 
-      int64_t staker_weight = weights[i];
+      int64_t staker_weight = tier_stake_weight(st.tier_stakes);
 
       float proportion = (float)staker_weight / total_weight;
 
       int64_t amount_for_staker = (int64_t)(quantity.amount  * proportion);
+      // never hand out more than the quantity, whatever the rounding
+      if (amount_for_staker > quantity.amount - amount_distributed) {
+         amount_for_staker = quantity.amount - amount_distributed;
+      }
 
       asset amount_asset;
       amount_asset.symbol = quantity.symbol;
@@ -433,11 +753,45 @@ int64_t token::distribute( asset quantity )
 
       add_balance( staker, amount_asset, _self);
       amount_distributed += amount_for_staker;
-   }
+   });
 
    return amount_distributed;
 }
 
+void token::xferresult( name         from,
+                        name         to,
+                        const asset& quantity,
+                        const asset& fee,
+                        const asset& to_stakers,
+                        const asset& to_self,
+                        uint32_t     expired_stakes )
+{
+   require_auth( _self );
+}
+
+void token::stakeresult( name            staker,
+                         uint64_t        stake_id,
+                         const asset&    total_stake,
+                         uint32_t        expired_stakes )
+{
+   require_auth( _self );
+}
+
+void token::acctresult( const std::vector<account_summary>& summaries )
+{
+   require_auth( _self );
+}
+
+void token::updateresult( uint32_t       expired_stakes,
+                          uint16_t       boost,
+                          const asset&   boost_amount,
+                          const asset&   to_stakers,
+                          const asset&   to_self,
+                          const asset&   fees_merged )
+{
+   require_auth( _self );
+}
+
 } /// namespace eosio
 
-EOSIO_DISPATCH( eosio::token, (create)(transfer)(transferstkd)(open)(close)(addstake)(update) )
+EOSIO_DISPATCH( eosio::token, (create)(transfer)(transferstkd)(open)(close)(openmany)(closemany)(addstake)(update)(migrstakes)(migrglobal)(acctsummary)(xferresult)(stakeresult)(updateresult)(acctresult) )